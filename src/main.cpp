@@ -30,6 +30,8 @@
 #include "FastLED.h"
 #include <IotWebConf.h>
 #include <IotWebConfUsing.h> // This loads aliases for easier class names.
+#include <time.h>
+#include <sys/time.h>
 // UpdateServer includes
 #ifdef ESP8266
 # include <ESP8266HTTPUpdateServer.h>
@@ -69,6 +71,22 @@ const char wifiInitialApPassword[] = "12345678";
 
 #define STRING_LEN 128
 
+// -- Group names are limited like the thing name, so that group topics plus a timed
+//      payload still fit into the 128 byte buffer of the MQTT client.
+#define GROUP_NAME_LEN 33
+
+// ------------------ Defines for MQTT -----------------
+
+// -- Default NTP server used to sync the clock for timed ("value@unixMillis") MQTT commands.
+#define NTP_SERVER "pool.ntp.org"
+
+// -- Timed commands further in the future than this are dropped.
+#define MaxApplyDelayMs 60000
+
+// -- Status publishes triggered by group/broadcast commands are delayed by a random
+//      amount up to this value, so a whole group does not answer the broker at once.
+#define MqttPublishJitterMs 2000
+
 // ------------------ Defines for WarpCore -----------------
 
 // For led chips like Neopixels, which have a data line, ground, and power, you just
@@ -101,10 +119,16 @@ void mqttMessageReceived(String &topic, String &payload);
 bool connectMqtt();
 bool connectMqttOptions();
 void mqttPublishAll();
+void mqttSubscribeSettings(const String &base);
+void scheduleMqttPublish(unsigned long maxJitterMs);
+void applySetting(int index, int value);
+void applyPendingSettings();
 // -- Callback methods.
 void wifiConnected();
 void configSaved();
 bool formValidator(iotwebconf::WebRequestWrapper* webRequestWrapper);
+bool isPrintableWord(const char* value, int length);
+bool isValidGroupName(const char* name, int length);
 
 
 DNSServer dnsServer;
@@ -120,6 +144,8 @@ MQTTClient mqttClient;
 char mqttServerValue[STRING_LEN];
 char mqttUserNameValue[STRING_LEN];
 char mqttUserPasswordValue[STRING_LEN];
+char mqttGroupNameValue[GROUP_NAME_LEN];
+char ntpServerValue[STRING_LEN];
 
 IotWebConf iotWebConf(thingName.c_str(), &dnsServer, &server, wifiInitialApPassword, CONFIG_VERSION);
 
@@ -128,12 +154,17 @@ IotWebConfParameterGroup mqttGroup = IotWebConfParameterGroup("mqtt", "MQTT conf
 IotWebConfTextParameter mqttServerParam = IotWebConfTextParameter("MQTT server", "mqttServer", mqttServerValue, STRING_LEN);
 IotWebConfTextParameter mqttUserNameParam = IotWebConfTextParameter("MQTT user", "mqttUser", mqttUserNameValue, STRING_LEN);
 IotWebConfPasswordParameter mqttUserPasswordParam = IotWebConfPasswordParameter("MQTT password", "mqttPass", mqttUserPasswordValue, STRING_LEN);
+IotWebConfTextParameter mqttGroupNameParam = IotWebConfTextParameter("MQTT group", "mqttGroupName", mqttGroupNameValue, GROUP_NAME_LEN);
+IotWebConfTextParameter ntpServerParam = IotWebConfTextParameter("NTP server", "ntpServer", ntpServerValue, STRING_LEN, NTP_SERVER);
 
 bool needMqttConnect = false;
 bool needReset = false;
 int pinState = HIGH;
 unsigned long lastReport = 0;
 unsigned long lastMqttConnectionAttempt = 0;
+bool needMqttPublish = false;
+unsigned long mqttPublishAt = 0;
+bool timeSynced = false;
 
 //variables for warpCore:
 // How many LEDs in your strip?
@@ -147,6 +178,15 @@ byte saturation = DefaultSaturation;
 byte brightness = DefaultBrightness;
 byte pattern = DefaultPattern;
 
+// Settings that can be changed via MQTT, indexed by applySetting()
+#define SettingCount 5
+const char* const settingNames[SettingCount] = {"warpFactor", "hue", "saturation", "brightness", "pattern"};
+
+// Timed MQTT commands waiting for their apply timestamp (unix time in ms)
+bool pendingSet[SettingCount];
+int pendingValue[SettingCount];
+uint64_t pendingApplyAt[SettingCount];
+
 
 // Define the array of LEDarray
 CRGB LEDarray[NUM_LEDS];
@@ -166,6 +206,8 @@ void setup()
   mqttGroup.addItem(&mqttServerParam);
   mqttGroup.addItem(&mqttUserNameParam);
   mqttGroup.addItem(&mqttUserPasswordParam);
+  mqttGroup.addItem(&mqttGroupNameParam);
+  mqttGroup.addItem(&ntpServerParam);
 
   iotWebConf.setStatusPin(STATUS_PIN);
   iotWebConf.setConfigPin(CONFIG_PIN);
@@ -188,6 +230,17 @@ void setup()
     mqttServerValue[0] = '\0';
     mqttUserNameValue[0] = '\0';
     mqttUserPasswordValue[0] = '\0';
+    mqttGroupNameValue[0] = '\0';
+  }
+  // -- Group name and NTP server were appended to an existing config version, so configs
+  //      saved by older firmware contain whatever was stored behind the MQTT settings.
+  if (!isValidGroupName(mqttGroupNameValue, GROUP_NAME_LEN))
+  {
+    mqttGroupNameValue[0] = '\0';
+  }
+  if (!isPrintableWord(ntpServerValue, STRING_LEN) || (ntpServerValue[0] == '\0'))
+  {
+    strncpy(ntpServerValue, NTP_SERVER, STRING_LEN);
   }
   // reduce this for debugging: 
   iotWebConf.setApTimeoutMs(2000);
@@ -257,6 +310,8 @@ void chase(bool Rainbow, bool Fade, bool SlowFade) {
 	}
 	// Ramp LED brightness
 	for(int value = 32; value < 512; value = value + Rate) {
+		// Check timed commands every frame, so all cores switch on the same frame
+		applyPendingSettings();
     if(value > 255){
       value = 255;
     }
@@ -316,6 +371,18 @@ void loop()
     ESP.restart();
   }
 
+  if (!timeSynced && timeIsSynced())
+  {
+    timeSynced = true;
+    Serial.println("Time synced via NTP, timed MQTT commands enabled.");
+  }
+
+  if (needMqttPublish && (long)(millis() - mqttPublishAt) >= 0)
+  {
+    needMqttPublish = false;
+    mqttPublishAll();
+  }
+
   // unsigned long now = millis();
   // if ((500 < now - lastReport) && (pinState != digitalRead(CONFIG_PIN)))
   // {
@@ -465,58 +532,25 @@ void handleRoot()
  */
 void handleSettings()
 {
-  if(server.hasArg("pattern")){
-    int t = server.arg("pattern").toInt();
-    if(t < 1) t=1;
-    if(t > 5) t=5;
-    pattern=t;
-    Serial.print("pattern = " );
-    Serial.println( pattern );
-  }
-  if(server.hasArg("brightness")){
-    int t = server.arg("brightness").toInt();
-    if(t < 0)   t=0;
-    if(t > 255) t=255;
-    brightness=t;
-    FastLED.setBrightness(brightness);
-    Serial.print("brightness = " );
-    Serial.println( brightness );
-  }
-  if(server.hasArg("hue")){
-    int t = server.arg("hue").toInt();
-    if(t < 0)   t=0;
-    if(t > 255) t=255;
-    hue=t;
-    MainHue = hue;
-    ReactorHue = hue;
-    Serial.print("hue = " );
-    Serial.println( hue );
-  }
-  if(server.hasArg("saturation")){
-    int t = server.arg("saturation").toInt();
-    if(t < 0)   t=0;
-    if(t > 255) t=255;
-    saturation=t;
-
-    Serial.print("saturation = " );
-    Serial.println( saturation );
-  }
-  if(server.hasArg("warpFactor")){
-    int t = server.arg("warpFactor").toInt();
-    if(t < 1) t=1;
-    if(t > 9) t=9;
-    warp_factor=t;
-    Rate = RateMultiplier * warp_factor;
-    Serial.print("warpFactor = " );
-    Serial.println( warp_factor );
+  for (int i = 0; i < SettingCount; i++)
+  {
+    if(server.hasArg(settingNames[i])){
+      // -- A manual change overrides a timed one still waiting.
+      pendingSet[i] = false;
+      applySetting(i, server.arg(settingNames[i]).toInt());
+    }
   }
   server.send(200, "text/plain", "Thanks!");
-  mqttPublishAll();
+  scheduleMqttPublish(0);
 }
 
 void wifiConnected()
 {
   needMqttConnect = true;
+  // -- UTC is sufficient, the clock is only used to line up timed MQTT commands.
+  Serial.print("Requesting time from ");
+  Serial.println(ntpServerValue);
+  configTime(0, 0, ntpServerValue);
 }
 
 void configSaved()
@@ -537,9 +571,65 @@ bool formValidator(iotwebconf::WebRequestWrapper* webRequestWrapper)
     valid = false;
   }
 
+  // -- "all" and "group" are the shared topics below /WarpCore/, not device names.
+  String thing = webRequestWrapper->arg(iotWebConf.getThingNameParameter()->getId());
+  if ((thing == "all") || (thing == "group"))
+  {
+    iotWebConf.getThingNameParameter()->errorMessage = "\"all\" and \"group\" are reserved names!";
+    valid = false;
+  }
+
+  String group = webRequestWrapper->arg(mqttGroupNameParam.getId());
+  if (group.length() > GROUP_NAME_LEN - 1)
+  {
+    mqttGroupNameParam.errorMessage = "Group name must not be longer than 32 characters!";
+    valid = false;
+  }
+  else if (!isValidGroupName(group.c_str(), GROUP_NAME_LEN))
+  {
+    mqttGroupNameParam.errorMessage = "Group name may only contain printable characters except spaces, '/', '+' and '#'!";
+    valid = false;
+  }
+
+  String ntp = webRequestWrapper->arg(ntpServerParam.getId());
+  if ((ntp.length() < 3) || !isPrintableWord(ntp.c_str(), STRING_LEN))
+  {
+    ntpServerParam.errorMessage = "Please provide a host name of at least 3 characters without spaces!";
+    valid = false;
+  }
+
   return valid;
 }
 
+/**
+ * Check that value is terminated within length and only contains printable,
+ * non-space characters.
+ */
+bool isPrintableWord(const char* value, int length)
+{
+  for (int i = 0; i < length; i++)
+  {
+    unsigned char c = value[i];
+    if (c == '\0')
+    {
+      return true;
+    }
+    if (!isgraph(c))
+    {
+      return false;
+    }
+  }
+  return false;
+}
+
+/**
+ * Group names form a single MQTT topic level, so wildcards and '/' are not allowed.
+ */
+bool isValidGroupName(const char* name, int length)
+{
+  return isPrintableWord(name, length) && (strpbrk(name, "/+#") == nullptr);
+}
+
 bool connectMqtt() {
   unsigned long now = millis();
   if (1000 > now - lastMqttConnectionAttempt)
@@ -555,11 +645,12 @@ bool connectMqtt() {
   Serial.println("Connected!");
 
 //  mqttClient.subscribe("/test/action");
-  mqttClient.subscribe("/WarpCore/"+ String(iotWebConf.getThingName()) +"/warpFactor");
-  mqttClient.subscribe("/WarpCore/"+ String(iotWebConf.getThingName()) +"/hue");
-  mqttClient.subscribe("/WarpCore/"+ String(iotWebConf.getThingName()) +"/saturation");
-  mqttClient.subscribe("/WarpCore/"+ String(iotWebConf.getThingName()) +"/brightness");
-  mqttClient.subscribe("/WarpCore/"+ String(iotWebConf.getThingName()) +"/pattern");
+  mqttSubscribeSettings("/WarpCore/"+ String(iotWebConf.getThingName()) +"/");
+  mqttSubscribeSettings("/WarpCore/all/");
+  if (mqttGroupNameValue[0] != '\0')
+  {
+    mqttSubscribeSettings("/WarpCore/group/"+ String(mqttGroupNameValue) +"/");
+  }
 
   mqttClient.publish("/WarpCore/"+ String(iotWebConf.getThingName())+ "/status/FWVersion",    String(FWVERSION));
   mqttClient.publish("/WarpCore/"+ String(iotWebConf.getThingName())+ "/status/FWDate",    String(__DATE__)+ " " +String(__TIME__));
@@ -567,6 +658,17 @@ bool connectMqtt() {
   return true;
 }
 
+void mqttSubscribeSettings(const String &base)
+{
+  for (int i = 0; i < SettingCount; i++)
+  {
+    if (!mqttClient.subscribe(base + settingNames[i]))
+    {
+      Serial.println("Subscribing to " + base + settingNames[i] + " failed!");
+    }
+  }
+}
+
 /*
 // -- This is an alternative MQTT connection method.
 bool connectMqtt() {
@@ -598,49 +700,160 @@ bool connectMqttOptions()
   return result;
 }
 
+bool timeIsSynced()
+{
+  // -- Before the first NTP answer the clock starts at 1970.
+  return time(nullptr) > 1600000000;
+}
+
+uint64_t syncedTimeMs()
+{
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/**
+ * Handle MQTT commands. Accepted topics are
+ *   /WarpCore/<thingName>/<setting>
+ *   /WarpCore/group/<groupName>/<setting>
+ *   /WarpCore/all/<setting>
+ * The payload is "<value>" or "<value>@<unix time in ms>"; the latter is
+ * held back until the (NTP synced) clock reaches the given time, so all
+ * cores receiving the same command switch together.
+ * Timed commands more than MaxApplyDelayMs ahead are dropped. Without NTP
+ * sync the wait cannot be honoured, so the value is applied right away to
+ * keep the core's state in line with the rest of the group.
+ */
 void mqttMessageReceived(String &topic, String &payload)
 {
   Serial.println("Incoming: " + topic + " - " + payload);
 
-  if(topic.indexOf("pattern")!=-1)
-  { 
-    pattern = payload.toInt();
-    Serial.print("pattern = ");
-    Serial.println( pattern );
+  String setting = topic.substring(topic.lastIndexOf('/') + 1);
+  int index = -1;
+  for (int i = 0; i < SettingCount; i++)
+  {
+    if (setting == settingNames[i])
+    {
+      index = i;
+    }
   }
+  if (index == -1)
+  {
+    return;
+  }
+
+  int value = payload.toInt();
+  bool shared = !topic.startsWith("/WarpCore/"+ String(iotWebConf.getThingName()) +"/");
 
-  if(topic.indexOf("hue")!=-1)
+  int at = payload.indexOf('@');
+  if (at != -1)
   {
-    hue = payload.toInt();
-    MainHue = hue;
-    ReactorHue = hue;
-    Serial.print("hue = ");
-    Serial.println( hue );
+    uint64_t applyAt = strtoull(payload.c_str() + at + 1, nullptr, 10);
+    uint64_t now = syncedTimeMs();
+    if (!timeIsSynced())
+    {
+      Serial.println("Time not synced, applying immediately.");
+    }
+    else if (applyAt > now + MaxApplyDelayMs)
+    {
+      Serial.println("Apply time too far in the future, command dropped.");
+      return;
+    }
+    else if (applyAt > now)
+    {
+      pendingSet[index] = true;
+      pendingValue[index] = value;
+      pendingApplyAt[index] = applyAt;
+      return;
+    }
   }
 
-  if(topic.indexOf("brightness")!=-1)
-  { 
-    brightness = payload.toInt();
-    FastLED.setBrightness(brightness);
-    Serial.print("brightness = " );
-    Serial.println( brightness );
+  // -- A newer immediate command overrides a timed one still waiting.
+  pendingSet[index] = false;
+  applySetting(index, value);
+  scheduleMqttPublish(shared ? MqttPublishJitterMs : 0);
+}
+
+/**
+ * Store a setting, clamped to its valid range.
+ * warpFactor 0 would stall chase(), so a single bad broadcast must not get through.
+ */
+void applySetting(int index, int value)
+{
+  byte stored;
+  switch(index)
+  {
+    case 0: warp_factor = constrain(value, 1, 9);
+            Rate = RateMultiplier * warp_factor;
+            stored = warp_factor;
+            break;
+    case 1: hue = constrain(value, 0, 255);
+            MainHue = hue;
+            ReactorHue = hue;
+            stored = hue;
+            break;
+    case 2: saturation = constrain(value, 0, 255);
+            stored = saturation;
+            break;
+    case 3: brightness = constrain(value, 0, 255);
+            FastLED.setBrightness(brightness);
+            stored = brightness;
+            break;
+    case 4: pattern = constrain(value, 1, 5);
+            stored = pattern;
+            break;
+    default: return;
   }
+  Serial.print(settingNames[index]);
+  Serial.print(" = ");
+  Serial.println(stored);
+}
 
-  if(topic.indexOf("saturation")!=-1)
+/**
+ * Apply timed commands that are due. Called for every frame from chase(),
+ * so only read the clock if something is waiting.
+ */
+void applyPendingSettings()
+{
+  bool applied = false;
+  uint64_t now = 0;
+  for (int i = 0; i < SettingCount; i++)
   {
-    saturation = payload.toInt();
-    Serial.print("saturation = ");
-    Serial.println( saturation );
+    if (!pendingSet[i])
+    {
+      continue;
+    }
+    if (now == 0)
+    {
+      now = syncedTimeMs();
+    }
+    if (now >= pendingApplyAt[i])
+    {
+      pendingSet[i] = false;
+      applySetting(i, pendingValue[i]);
+      applied = true;
+    }
   }
+  if (applied)
+  {
+    // -- Timed commands are usually sent to many cores, so spread the answers.
+    scheduleMqttPublish(MqttPublishJitterMs);
+  }
+}
 
-  if(topic.indexOf("warpFactor")!=-1)
+/**
+ * Request a mqttPublishAll() from the main loop within maxJitterMs.
+ * Several requests are coalesced into a single publish.
+ */
+void scheduleMqttPublish(unsigned long maxJitterMs)
+{
+  unsigned long at = millis() + (maxJitterMs > 0 ? random(maxJitterMs) : 0);
+  if (!needMqttPublish || (long)(at - mqttPublishAt) < 0)
   {
-    warp_factor = payload.toInt();
-    Rate = RateMultiplier * warp_factor;
-    Serial.print("warpFactor = ");
-    Serial.println( warp_factor );
+    mqttPublishAt = at;
   }
-  mqttPublishAll();
+  needMqttPublish = true;
 }
 
 void mqttPublishAll()